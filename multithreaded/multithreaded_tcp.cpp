@@ -7,6 +7,8 @@
 #include <pthread.h>
 #include <vector>
 
+#include "project1/chat_core.h"
+
 using namespace std;
 void *respond(void *arg);
 int thread_count = 0;
@@ -77,7 +79,6 @@ void *respond(void *arg)
     char buffer[1024] = {0};
     char return_message[1024] = {0};
     int nBytes;
-    char *temp, *t;
     vector<string> token;
 
     new_socket = *((int *)arg);
@@ -87,14 +88,7 @@ void *respond(void *arg)
         if (nBytes!=0)
         {
             cout << "I received: " << buffer << endl;
-            temp = strdup(buffer);
-            t = strtok(temp, " ");
-            
-            while(t!=NULL)
-            {
-                token.push_back(t);
-                t = strtok(NULL, " ");
-            }
+            tokenize(buffer, token);
 
             printf("Tokens are:\n");
             for (auto i: token)
@@ -0,0 +1,293 @@
+// Microbenchmarks for the chat servers' hot-path primitives.
+//
+// Every case calls the servers' own primitives from chat_core.h.
+//
+// Output is CSV on stdout (one row per case). Save it and pass it back with
+// --baseline to get per-case deltas:
+//   ./bench.exe > base.csv
+//   ./bench.exe --baseline base.csv
+//
+// allocs_per_op counts malloc/calloc/realloc calls, which covers operator new
+// and strdup too (glibc only: the wrappers forward to __libc_malloc & co).
+//
+// Options: --filter <substr>  --min-ms <n>  --baseline <file>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "chat_core.h"
+
+using namespace std;
+
+// ---- Allocation counting ----
+static atomic<uint64_t> alloc_count{0};
+
+extern "C" {
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t n);
+void  __libc_free(void* p);
+
+void* malloc(size_t n) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    return __libc_malloc(n);
+}
+void* calloc(size_t n, size_t size) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+void* realloc(void* p, size_t n) {
+    alloc_count.fetch_add(1, memory_order_relaxed);
+    return __libc_realloc(p, n);
+}
+void free(void* p) { __libc_free(p); }
+}
+
+// Keeps the optimizer from discarding a result.
+template <class T> static void keep(T const& v) { asm volatile("" : : "g"(&v) : "memory"); }
+
+// ---- Harness ----
+struct Result {
+    string name;
+    string param;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+static string filter;
+static int min_ms = 200;
+static vector<Result> results;
+
+// Runs `op` in growing batches until min_ms elapsed. `bytes` is the payload
+// moved per op, used for throughput.
+static void run(const string& name, const string& param, double bytes,
+                const function<void()>& op) {
+    string full = name + "/" + param;
+    if (!filter.empty() && full.find(filter) == string::npos) return;
+
+    op();  // warm-up
+    uint64_t iters = 0, batch = 1, allocs = 0;
+    chrono::nanoseconds elapsed{0};
+    while (elapsed < chrono::milliseconds(min_ms)) {
+        uint64_t a0 = alloc_count.load(memory_order_relaxed);
+        auto t0 = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; ++i) op();
+        elapsed += chrono::steady_clock::now() - t0;
+        allocs  += alloc_count.load(memory_order_relaxed) - a0;
+        iters   += batch;
+        if (batch < (1u << 20)) batch *= 2;
+    }
+    results.push_back(Result{name, param,
+                             (double)elapsed.count() / iters,
+                             (double)allocs / iters, bytes});
+}
+
+// ---- Kernel: broadcast_except (chat_core.h, used by tcp_server.cpp) ----
+// Recipients are TCP loopback connections whose far ends a drain thread keeps
+// reading, so every send() is a real TCP send that only blocks while the
+// reader catches up. At most FD_POOL connections are opened; larger client
+// lists repeat them.
+static const size_t FD_POOL = 256;
+static atomic<bool> draining{false};
+
+// Allocates nothing, so it does not skew allocs_per_op.
+static void* drain_loop(void* arg) {
+    vector<pollfd>& pfds = *reinterpret_cast<vector<pollfd>*>(arg);
+    static char buf[1 << 16];
+    while (draining.load(memory_order_relaxed)) {
+        if (poll(pfds.data(), pfds.size(), 50) <= 0) continue;
+        for (auto& p : pfds)
+            if (p.revents & POLLIN) recv(p.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    }
+    return nullptr;
+}
+
+static void bench_broadcast(const vector<size_t>& counts, const vector<size_t>& sizes) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(lfd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0 ||
+        getsockname(lfd, (sockaddr*)&addr, &len) < 0) {
+        cerr << "broadcast: cannot listen on loopback\n";
+        close(lfd);
+        return;
+    }
+
+    // Server side of each pair is the Client (it closes its fd); far ends drain
+    vector<shared_ptr<Client>> pool;
+    vector<int> far_ends;
+    for (size_t i = 0; i < FD_POOL; ++i) {
+        int cfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (cfd < 0) break;
+        if (connect(cfd, (sockaddr*)&addr, sizeof(addr)) < 0) { close(cfd); break; }
+        int sfd = accept(lfd, nullptr, nullptr);
+        if (sfd < 0) { close(cfd); break; }
+        pool.push_back(make_shared<Client>(sfd));
+        far_ends.push_back(cfd);
+    }
+    close(lfd);
+    if (pool.empty()) { cerr << "broadcast: no sockets available\n"; return; }
+
+    vector<pollfd> pfds;
+    for (int fd : far_ends) pfds.push_back(pollfd{fd, POLLIN, 0});
+    draining = true;
+    pthread_t drainer;
+    pthread_create(&drainer, nullptr, drain_loop, &pfds);
+
+    ClientList clients;
+    for (size_t n : counts) {
+        clients.list.clear();
+        for (size_t i = 0; i < n; ++i) clients.list.push_back(pool[i % pool.size()]);
+        for (size_t sz : sizes) {
+            string msg(sz, 'x');
+            run("broadcast_except", "clients=" + to_string(n) + ",bytes=" + to_string(sz),
+                (double)sz * n, [&] { broadcast_except(clients, -1, msg); });
+        }
+    }
+
+    draining = false;
+    pthread_join(drainer, nullptr);
+    clients.list.clear();
+    pool.clear();
+    for (int fd : far_ends) close(fd);
+}
+
+// ---- Kernel: tokenize (chat_core.h, used by ../multithreaded_tcp.cpp) ----
+static void bench_tokenize(const vector<size_t>& sizes) {
+    for (size_t sz : sizes) {
+        string input;
+        while (input.size() < sz) input += "word ";
+        input.resize(sz);
+        vector<string> token;
+
+        run("respond_tokenize", "bytes=" + to_string(sz), (double)sz, [&] {
+            tokenize(input.c_str(), token);
+            keep(token);
+            token.clear();
+        });
+    }
+}
+
+// ---- Kernel: MsgHeader decode + re-encode (chat_core.h, udp_server.cpp) ----
+static void bench_header(const vector<size_t>& sizes) {
+    for (size_t sz : sizes) {
+        size_t plen = min<size_t>(sz, UINT16_MAX);
+        vector<char> payload(plen, 'p');
+        auto in = encode_packet(MSG_CHAT, 7u, payload.data(), plen);
+        size_t n = in->size();
+
+        run("msgheader_codec", "bytes=" + to_string(plen), (double)plen, [&] {
+            MsgHeader hdr;
+            if (!decode_header(in->data(), n, hdr)) return;
+            size_t p = payload_len(hdr, n);
+            auto out = encode_packet(MSG_CHAT, hdr.seq, in->data() + sizeof(MsgHeader), p);
+            keep(out);
+        });
+    }
+}
+
+// ---- Kernel: find_endpoint scan (chat_core.h, udp_server.cpp add_client) ----
+static sockaddr_in make_ep(uint32_t i) {
+    sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(0x0A000000u | (i >> 16));
+    a.sin_port = htons((uint16_t)(i & 0xFFFF));
+    return a;
+}
+
+static void bench_add_client(const vector<size_t>& counts) {
+    for (size_t n : counts) {
+        vector<Endpoint> eps;
+        for (size_t i = 0; i < n; ++i) { Endpoint e; e.addr = make_ep((uint32_t)i); e.max_seq = 0; e.window = 0; eps.push_back(e); }
+        uint32_t probe = 0;
+
+        // Lookup of an already-registered client (the common HELLO retry case);
+        // probes rotate so the average scan length is n/2.
+        run("add_client_scan", "clients=" + to_string(n), 0, [&] {
+            sockaddr_in ep = make_ep(probe);
+            probe = (probe + 7919) % (uint32_t)n;
+            keep(find_endpoint(eps, ep));
+        });
+    }
+}
+
+// ---- Baseline ----
+static map<string, double> load_baseline(const string& path) {
+    map<string, double> base;
+    ifstream in(path);
+    if (!in) { cerr << "Cannot open baseline " << path << "\n"; exit(EXIT_FAILURE); }
+    string line;
+    getline(in, line);  // header
+    while (getline(in, line)) {
+        istringstream row(line);
+        string name, param, ns;
+        if (getline(row, name, ',') && getline(row, param, '"') &&
+            getline(row, param, '"') && getline(row, ns, ',') && getline(row, ns, ','))
+            base[name + "/" + param] = atof(ns.c_str());
+    }
+    return base;
+}
+
+int main(int argc, char** argv) {
+    string baseline_path;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--filter" && i + 1 < argc)        filter = argv[++i];
+        else if (a == "--min-ms" && i + 1 < argc)   min_ms = atoi(argv[++i]);
+        else if (a == "--baseline" && i + 1 < argc) baseline_path = argv[++i];
+        else {
+            cerr << "usage: " << argv[0] << " [--filter substr] [--min-ms n] [--baseline file.csv]\n";
+            return 1;
+        }
+    }
+    map<string, double> base;
+    if (!baseline_path.empty()) base = load_baseline(baseline_path);
+
+    const vector<size_t> counts = {10, 1000, 100000};
+    const vector<size_t> sizes  = {16, 1024, 65536};
+
+    bench_broadcast(counts, sizes);
+    bench_tokenize({16, 1024, 65536});
+    bench_header({16, 1024, 65535});
+    bench_add_client(counts);
+
+    cout << "name,param,ns_per_op,allocs_per_op,mb_per_s,ops_per_s";
+    if (!base.empty()) cout << ",baseline_ns_per_op,delta_pct";
+    cout << "\n";
+    for (auto& r : results) {
+        double mbps = r.bytes_per_op ? r.bytes_per_op / r.ns_per_op * 1e3 : 0;
+        cout << r.name << ",\"" << r.param << "\"," << r.ns_per_op << ","
+             << r.allocs_per_op << "," << mbps << "," << 1e9 / r.ns_per_op;
+        if (!base.empty()) {
+            auto it = base.find(r.name + "/" + r.param);
+            if (it != base.end() && it->second > 0)
+                cout << "," << it->second << "," << (r.ns_per_op / it->second - 1) * 100;
+            else
+                cout << ",,";
+        }
+        cout << "\n";
+    }
+    return 0;
+}
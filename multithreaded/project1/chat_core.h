@@ -0,0 +1,212 @@
+// Hot-path primitives shared by the chat servers and bench.cpp, so the
+// benchmarks time the same code the servers run.
+//
+//   TCP: Client, ClientList, send_control/send_bulk, broadcast_except
+//   UDP: MsgHeader codec, Endpoint lookup, duplicate-suppression window
+//   ../multithreaded_tcp.cpp: tokenize
+#ifndef CHAT_CORE_H
+#define CHAT_CORE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+// ---- TCP clients ----
+
+// Each client socket has two send lanes. A sender owns the socket while
+// `busy`; control replies (e.g. /stats) register in ctrl_pending and bulk
+// fan-out sleeps on send_cv until none are waiting. The fd is closed when the
+// last reference (handler thread or an in-flight broadcast snapshot) goes away.
+struct Client {
+    int fd;
+    pthread_mutex_t send_mtx;   // guards busy and ctrl_pending, not the send
+    pthread_cond_t send_cv;
+    bool busy;
+    int ctrl_pending;
+
+    explicit Client(int f) : fd(f), busy(false), ctrl_pending(0) {
+        pthread_mutex_init(&send_mtx, nullptr);
+        pthread_cond_init(&send_cv, nullptr);
+    }
+    ~Client() {
+        close(fd);
+        pthread_mutex_destroy(&send_mtx);
+        pthread_cond_destroy(&send_cv);
+    }
+};
+
+struct ClientList {
+    pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;        // guards list
+    pthread_mutex_t bcast_mtx = PTHREAD_MUTEX_INITIALIZER;  // one fan-out at a time
+    std::vector<std::shared_ptr<Client>> list;
+};
+
+static inline void release_socket(Client& c) {
+    pthread_mutex_lock(&c.send_mtx);
+    c.busy = false;
+    pthread_cond_broadcast(&c.send_cv);
+    pthread_mutex_unlock(&c.send_mtx);
+}
+
+// High-priority lane: waits only for the send in progress, if any.
+static inline void send_control(Client& c, const std::string& msg) {
+    pthread_mutex_lock(&c.send_mtx);
+    c.ctrl_pending++;
+    while (c.busy) pthread_cond_wait(&c.send_cv, &c.send_mtx);
+    c.ctrl_pending--;
+    c.busy = true;
+    pthread_mutex_unlock(&c.send_mtx);
+
+    send(c.fd, msg.c_str(), msg.size(), MSG_NOSIGNAL);
+    release_socket(c);
+}
+
+// Bulk lane: sleeps while the socket is busy or a control reply is waiting.
+static inline void send_bulk(Client& c, const std::string& msg) {
+    pthread_mutex_lock(&c.send_mtx);
+    while (c.busy || c.ctrl_pending > 0) pthread_cond_wait(&c.send_cv, &c.send_mtx);
+    c.busy = true;
+    pthread_mutex_unlock(&c.send_mtx);
+
+    send(c.fd, msg.c_str(), msg.size(), MSG_NOSIGNAL);
+    release_socket(c);
+}
+
+// Ordering: fan-outs are serialized on bcast_mtx, so every client receives
+// broadcasts in the same order. The client list itself is only locked to copy
+// it, so connects, disconnects and /stats never wait behind a fan-out.
+// trace_id != 0 records lock wait and every recipient send (see trace.h).
+static inline void broadcast_except(ClientList& clients, int sender_fd,
+                                    const std::string& msg,
+                                    unsigned long long trace_id = 0) {
+    long long t_lock = trace_start(trace_id);
+    pthread_mutex_lock(&clients.bcast_mtx);
+    pthread_mutex_lock(&clients.mtx);
+    trace_span(trace_id, "lock_wait", t_lock);
+    std::vector<std::shared_ptr<Client>> targets(clients.list);
+    pthread_mutex_unlock(&clients.mtx);
+
+    for (auto& c : targets) {
+        if (c->fd == sender_fd) continue;
+        long long t_send = trace_start(trace_id);
+        send_bulk(*c, msg);
+        trace_span(trace_id, "send", t_send, c->fd);
+    }
+    pthread_mutex_unlock(&clients.bcast_mtx);
+}
+
+// ---- UDP wire format ----
+
+#pragma pack(push,1)
+struct MsgHeader {
+    uint16_t type;   // 1=HELLO, 2=CHAT, 3=ACK
+    uint32_t seq;    // for CHAT and ACK
+    uint16_t len;    // payload length (bytes)
+};
+#pragma pack(pop)
+
+static const uint16_t MSG_HELLO = 1;
+static const uint16_t MSG_CHAT  = 2;
+static const uint16_t MSG_ACK   = 3;
+
+// Decodes the header of an n-byte datagram; false if it is too short.
+static inline bool decode_header(const char* buf, size_t n, MsgHeader& hdr) {
+    if (n < sizeof(MsgHeader)) return false;
+    memcpy(&hdr, buf, sizeof(hdr));
+    hdr.type = ntohs(hdr.type);
+    hdr.seq  = ntohl(hdr.seq);
+    hdr.len  = ntohs(hdr.len);
+    return true;
+}
+
+// Payload bytes actually present, clamped to the header's len.
+static inline size_t payload_len(const MsgHeader& hdr, size_t n) {
+    if (n <= sizeof(MsgHeader)) return 0;
+    return std::min<size_t>(hdr.len, n - sizeof(MsgHeader));
+}
+
+// Builds a packet (header + payload) that can be shared by many sends.
+static inline std::shared_ptr<std::vector<char>>
+encode_packet(uint16_t type, uint32_t seq, const char* payload, size_t plen) {
+    auto out = std::make_shared<std::vector<char>>(sizeof(MsgHeader) + plen);
+    MsgHeader h{htons(type), htonl(seq), htons((uint16_t)plen)};
+    memcpy(out->data(), &h, sizeof(h));
+    if (plen) memcpy(out->data() + sizeof(MsgHeader), payload, plen);
+    return out;
+}
+
+// ---- UDP endpoints ----
+
+// Duplicate suppression: max_seq is the highest CHAT seq accepted from this
+// endpoint and bit i of window is set when (max_seq - i) has been accepted,
+// so retransmissions are recognised in constant space per client.
+// udp_client is stop-and-wait: a retransmission repeats the latest seq, or
+// at worst the one before it (a late copy of it), so two seqs are enough.
+static const uint32_t DEDUP_WINDOW = 2;
+
+struct Endpoint {
+    sockaddr_in addr;
+    uint32_t max_seq;
+    uint64_t window;
+};
+
+static inline bool same_ep(const sockaddr_in& a, const sockaddr_in& b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+static inline Endpoint* find_endpoint(std::vector<Endpoint>& eps, const sockaddr_in& ep) {
+    for (auto &c : eps) if (same_ep(c.addr, ep)) return &c;
+    return nullptr;
+}
+
+// True when seq is below max_seq - 1, which no retransmission can be: the
+// client restarted on the same ip:port and its HELLO was lost, i.e. a new
+// session. (After an old session of only one or two messages the restart is
+// indistinguishable from a retransmission and is still suppressed.)
+static inline bool behind_window(const Endpoint& e, uint32_t seq) {
+    return seq < e.max_seq && e.max_seq - seq >= DEDUP_WINDOW;
+}
+
+// Records seq for this endpoint; returns true if it was already seen. A seq
+// behind the window restarts the window at seq (see behind_window).
+static inline bool seen_before(Endpoint& e, uint32_t seq) {
+    if (seq > e.max_seq) {
+        uint32_t shift = seq - e.max_seq;
+        e.window = (shift >= DEDUP_WINDOW) ? 1 : (e.window << shift) | 1;
+        e.max_seq = seq;
+        return false;
+    }
+    if (behind_window(e, seq)) {
+        e.max_seq = seq;
+        e.window = 1;
+        return false;
+    }
+    uint64_t bit = 1ull << (e.max_seq - seq);
+    if (e.window & bit) return true;
+    e.window |= bit;
+    return false;
+}
+
+// ---- Command tokenizing (../multithreaded_tcp.cpp) ----
+
+// Splits buf on spaces with strtok on a private copy, appending to token.
+static inline void tokenize(const char* buf, std::vector<std::string>& token) {
+    char* temp = strdup(buf);
+    for (char* t = strtok(temp, " "); t != NULL; t = strtok(NULL, " "))
+        token.push_back(t);
+    free(temp);
+}
+
+#endif
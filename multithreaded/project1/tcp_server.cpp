@@ -8,24 +8,433 @@
 #include <vector>
 #include <algorithm>
 #include <chrono>
+#include <string>
+#include <sstream>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <atomic>
+
+#include "chat_core.h"
+#include "trace.h"
 
 using namespace std;
 
-static pthread_mutex_t clients_mtx = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t count_mtx   = PTHREAD_MUTEX_INITIALIZER;
-static vector<int> clients;
+static ClientList clients;
+static atomic<int> client_count{0};
 static int thread_count = 0;
 static auto server_start = std::chrono::steady_clock::now();
 
+// ---- Federation ----
+// Nodes peer over persistent TCP links using newline-terminated lines:
+//   NODE  <node_id>                        (first line on every link)
+//   RELAY <origin> <msg_id> <text>         (one per /say, flooded once per link)
+//   COUNT <origin> <version> <clients>     (periodic client-count gossip)
+// (origin, msg_id) / (origin, version) let every node drop duplicates, so
+// any connected topology works, not only a full mesh.
+// When two nodes dial each other, both ends keep the link dialed by the lower
+// node id and drop the other one.
+// Every link has its own outbound queue drained by a writer thread, so no
+// thread blocks on a peer socket while holding peers_mtx or reading a link.
+struct PeerLink {
+    int fd;
+    std::string node;   // empty until NODE line is received (peers_mtx)
+    bool dialed;        // we connected out (false = accepted)
+
+    pthread_mutex_t out_mtx;
+    pthread_cond_t out_cv;
+    deque<std::string> outq;
+    bool closing;
+
+    PeerLink(int f, bool d) : fd(f), dialed(d), closing(false) {
+        pthread_mutex_init(&out_mtx, nullptr);
+        pthread_cond_init(&out_cv, nullptr);
+    }
+    ~PeerLink() { pthread_mutex_destroy(&out_mtx); pthread_cond_destroy(&out_cv); }
+};
+
+// A peer this far behind is treated as dead; it redials and resyncs.
+static const size_t PEER_QUEUE_MAX = 10000;
+
+struct NodeCount {
+    long long version;
+    int clients;
+    std::chrono::steady_clock::time_point seen;
+};
+
+static pthread_mutex_t peers_mtx = PTHREAD_MUTEX_INITIALIZER;
+static vector<shared_ptr<PeerLink>> peers;
+static std::string node_id;
+
+static pthread_mutex_t seen_mtx = PTHREAD_MUTEX_INITIALIZER;
+static set<pair<std::string, unsigned long long>> seen_ids;
+static deque<pair<std::string, unsigned long long>> seen_order;
+static const size_t SEEN_CAP = 8192;
+static unsigned long long next_msg_id = 0;
+
+static pthread_mutex_t counts_mtx = PTHREAD_MUTEX_INITIALIZER;
+static map<std::string, NodeCount> node_counts;
+static const int COUNT_PERIOD_S = 2;
+static const int COUNT_EXPIRE_S = 3 * COUNT_PERIOD_S;
+
+// RELAYed text is fanned out to local clients by one worker thread, so a
+// peer link's reader never waits on a client socket. A client that stops
+// reading would otherwise stall the link (COUNT included) until the peer
+// expired. One worker keeps relayed messages in arrival order.
+struct Fanout {
+    std::string text;
+    unsigned long long trace_id;
+    long long t_recv;
+};
+static pthread_mutex_t fanout_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fanout_cv = PTHREAD_COND_INITIALIZER;
+static deque<Fanout> fanout_q;
+static bool fanout_dropping = false;   // logged once per overflow
+static const size_t FANOUT_QUEUE_MAX = 10000;
+
 void* respond(void* arg);
 
-static void broadcast_except(int sender_fd, const std::string& msg) {
-    pthread_mutex_lock(&clients_mtx);
-    for (int fd : clients) {
-        if (fd == sender_fd) continue;
-        send(fd, msg.c_str(), msg.size(), 0);
+static bool send_all(int fd, const std::string& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        off += (size_t)n;
+    }
+    return true;
+}
+
+// Queues one line for a link's writer. Never blocks on the socket.
+static void peer_enqueue(PeerLink& p, const std::string& line) {
+    pthread_mutex_lock(&p.out_mtx);
+    if (!p.closing) {
+        if (p.outq.size() >= PEER_QUEUE_MAX) {
+            cout << "Peer queue full, dropping link" << endl;
+            p.closing = true;
+            shutdown(p.fd, SHUT_RDWR);
+        } else {
+            p.outq.push_back(line);
+        }
+        pthread_cond_signal(&p.out_cv);
+    }
+    pthread_mutex_unlock(&p.out_mtx);
+}
+
+static void* peer_writer(void* arg) {
+    PeerLink* p = reinterpret_cast<PeerLink*>(arg);
+    pthread_mutex_lock(&p->out_mtx);
+    while (true) {
+        while (p->outq.empty() && !p->closing) pthread_cond_wait(&p->out_cv, &p->out_mtx);
+        if (p->closing) break;
+        std::string line = std::move(p->outq.front());
+        p->outq.pop_front();
+        pthread_mutex_unlock(&p->out_mtx);
+        bool ok = send_all(p->fd, line);
+        pthread_mutex_lock(&p->out_mtx);
+        if (!ok) {
+            p->closing = true;
+            shutdown(p->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&p->out_mtx);
+    return nullptr;
+}
+
+// Queues one line for every peer link except `except_fd` (-1 = all).
+static void relay_to_peers(int except_fd, const std::string& line) {
+    vector<shared_ptr<PeerLink>> targets;
+    pthread_mutex_lock(&peers_mtx);
+    for (auto& p : peers) {
+        if (p->fd == except_fd || p->node.empty()) continue;
+        targets.push_back(p);
+    }
+    pthread_mutex_unlock(&peers_mtx);
+    for (auto& p : targets) peer_enqueue(*p, line);
+}
+
+static void fanout_enqueue(const std::string& text, unsigned long long trace_id, long long t_recv) {
+    pthread_mutex_lock(&fanout_mtx);
+    if (fanout_q.size() >= FANOUT_QUEUE_MAX) {
+        if (!fanout_dropping) cout << "Relay fan-out queue full, dropping messages" << endl;
+        fanout_dropping = true;
+        trace_span(trace_id, "dropped", t_recv);
+    } else {
+        fanout_dropping = false;
+        fanout_q.push_back(Fanout{text, trace_id, t_recv});
+        pthread_cond_signal(&fanout_cv);
+    }
+    pthread_mutex_unlock(&fanout_mtx);
+}
+
+static void* fanout_worker(void*) {
+    while (true) {
+        pthread_mutex_lock(&fanout_mtx);
+        while (fanout_q.empty()) pthread_cond_wait(&fanout_cv, &fanout_mtx);
+        Fanout f = std::move(fanout_q.front());
+        fanout_q.pop_front();
+        pthread_mutex_unlock(&fanout_mtx);
+        trace_span(f.trace_id, "fanout_wait", f.t_recv);
+
+        long long t_bcast = trace_start(f.trace_id);
+        broadcast_except(clients, -1, f.text, f.trace_id);
+        trace_span(f.trace_id, "broadcast", t_bcast);
+        trace_span(f.trace_id, "message", f.t_recv);
+    }
+    return nullptr;
+}
+
+// Returns true the first time (origin, id) is observed.
+static bool mark_seen(const std::string& origin, unsigned long long id) {
+    auto key = make_pair(origin, id);
+    pthread_mutex_lock(&seen_mtx);
+    bool fresh = seen_ids.insert(key).second;
+    if (fresh) {
+        seen_order.push_back(key);
+        if (seen_order.size() > SEEN_CAP) {
+            seen_ids.erase(seen_order.front());
+            seen_order.pop_front();
+        }
+    }
+    pthread_mutex_unlock(&seen_mtx);
+    return fresh;
+}
+
+// Stores a node's count if it is newer than what we have.
+static bool update_count(const std::string& origin, long long version, int n) {
+    bool fresh = false;
+    pthread_mutex_lock(&counts_mtx);
+    auto it = node_counts.find(origin);
+    if (it == node_counts.end() || version > it->second.version) {
+        node_counts[origin] = NodeCount{version, n, std::chrono::steady_clock::now()};
+        fresh = true;
+    }
+    pthread_mutex_unlock(&counts_mtx);
+    return fresh;
+}
+
+static void announce_count() {
+    int n = client_count.load();
+
+    // Wall-clock ms so a restarted node is not shadowed by its old version.
+    long long version = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    update_count(node_id, version, n);
+    relay_to_peers(-1, "COUNT " + node_id + " " + std::to_string(version) +
+                       " " + std::to_string(n) + "\n");
+}
+
+// Sums live node counts; entries not refreshed recently are dropped.
+static void cluster_totals(int& total_clients, int& nodes) {
+    auto now = std::chrono::steady_clock::now();
+    total_clients = 0;
+    nodes = 0;
+    pthread_mutex_lock(&counts_mtx);
+    for (auto it = node_counts.begin(); it != node_counts.end(); ) {
+        if (it->first != node_id &&
+            now - it->second.seen > std::chrono::seconds(COUNT_EXPIRE_S)) {
+            it = node_counts.erase(it);
+            continue;
+        }
+        total_clients += it->second.clients;
+        nodes++;
+        ++it;
+    }
+    pthread_mutex_unlock(&counts_mtx);
+}
+
+// Handles one line received on a peer link. Returns false to drop the link.
+static bool handle_peer_line(int fd, const std::string& line) {
+    istringstream in(line);
+    std::string kind;
+    in >> kind;
+
+    if (kind == "NODE") {
+        std::string remote;
+        in >> remote;
+        if (remote.empty() || remote == node_id) return false;
+        bool keep = true;
+        pthread_mutex_lock(&peers_mtx);
+        PeerLink* self  = nullptr;
+        PeerLink* other = nullptr;
+        for (auto& p : peers) {
+            if (p->fd == fd) self = p.get();
+            else if (p->node == remote) other = p.get();
+        }
+        if (self && other) {
+            // Both ends see the same dialer for each link, so they agree
+            const std::string& self_dialer  = self->dialed  ? node_id : remote;
+            const std::string& other_dialer = other->dialed ? node_id : remote;
+            keep = self_dialer != other_dialer && self_dialer == min(node_id, remote);
+            if (keep) {
+                other->node.clear();
+                shutdown(other->fd, SHUT_RDWR);
+            }
+        }
+        if (keep && self) self->node = remote;
+        pthread_mutex_unlock(&peers_mtx);
+        if (!keep) return false;
+        cout << "Peer linked: " << remote << endl;
+        announce_count();
+    } else if (kind == "RELAY") {
+        unsigned long long trace_id = trace_begin();
+        long long t_recv = trace_start(trace_id);
+        trace_mark(trace_id, "recv", t_recv, (int)line.size());
+
+        std::string origin;
+        unsigned long long id;
+        if (!(in >> origin >> id)) return true;
+        if (!mark_seen(origin, id)) {
+            trace_span(trace_id, "duplicate", t_recv);
+            return true;
+        }
+        std::string text;
+        in.get();  // single separator space
+        getline(in, text);
+        trace_span(trace_id, "parse", t_recv);
+
+        // The worker ends the "message" span once local fan-out is done
+        fanout_enqueue(text, trace_id, t_recv);
+        long long t_relay = trace_start(trace_id);
+        relay_to_peers(fd, line + "\n");
+        trace_span(trace_id, "relay", t_relay);
+    } else if (kind == "COUNT") {
+        std::string origin;
+        long long version;
+        int n;
+        if (!(in >> origin >> version >> n)) return true;
+        if (origin == node_id) return true;
+        if (update_count(origin, version, n)) relay_to_peers(fd, line + "\n");
+    }
+    return true;
+}
+
+static bool peer_linked(const std::string& node) {
+    bool linked = false;
+    pthread_mutex_lock(&peers_mtx);
+    for (auto& p : peers) if (p->node == node) linked = true;
+    pthread_mutex_unlock(&peers_mtx);
+    return linked;
+}
+
+// Runs a peer link until it fails; used by both dialing and accepting sides.
+// Returns the remote node id if it announced one.
+static std::string peer_session(int fd, bool dialed) {
+    auto link = make_shared<PeerLink>(fd, dialed);
+    pthread_mutex_lock(&peers_mtx);
+    peers.push_back(link);
+    pthread_mutex_unlock(&peers_mtx);
+
+    pthread_t writer;
+    pthread_create(&writer, nullptr, peer_writer, link.get());
+    peer_enqueue(*link, "NODE " + node_id + "\n");
+
+    char buffer[4096];
+    std::string pending;
+    std::string learned;
+    int nBytes;
+    bool alive = true;
+    while (alive && (nBytes = read(fd, buffer, sizeof(buffer))) > 0) {
+        pending.append(buffer, nBytes);
+        size_t pos;
+        while (alive && (pos = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, pos);
+            pending.erase(0, pos + 1);
+            if (line.rfind("NODE ", 0) == 0) learned = line.substr(5);
+            alive = handle_peer_line(fd, line);
+        }
+    }
+
+    std::string remote;
+    pthread_mutex_lock(&peers_mtx);
+    for (auto it = peers.begin(); it != peers.end(); ++it) {
+        if (*it == link) { remote = link->node; peers.erase(it); break; }
+    }
+    pthread_mutex_unlock(&peers_mtx);
+
+    // Stop the writer (shutdown unblocks a send in progress) before closing
+    pthread_mutex_lock(&link->out_mtx);
+    link->closing = true;
+    pthread_cond_signal(&link->out_cv);
+    pthread_mutex_unlock(&link->out_mtx);
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(writer, nullptr);
+    close(fd);
+    if (!remote.empty()) cout << "Peer lost: " << remote << endl;
+    return learned;
+}
+
+static void* peer_accepted(void* arg) {
+    int fd = *reinterpret_cast<int*>(arg);
+    delete reinterpret_cast<int*>(arg);
+    peer_session(fd, false);
+    pthread_exit(nullptr);
+}
+
+static void* peer_listener(void* arg) {
+    int listen_fd = *reinterpret_cast<int*>(arg);
+    delete reinterpret_cast<int*>(arg);
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) continue;
+        pthread_t tid;
+        pthread_create(&tid, nullptr, peer_accepted, new int(fd));
+        pthread_detach(tid);
+    }
+    return nullptr;
+}
+
+// Keeps a configured peer linked, redialing after failures. Once the node
+// behind the address is known, no dial is made while any link to it exists
+// (e.g. the one it dialed to us).
+static void* peer_dialer(void* arg) {
+    sockaddr_in addr = *reinterpret_cast<sockaddr_in*>(arg);
+    delete reinterpret_cast<sockaddr_in*>(arg);
+    std::string known;
+    while (true) {
+        if (known.empty() || !peer_linked(known)) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+                std::string remote = peer_session(fd, true);
+                if (!remote.empty()) known = remote;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        sleep(COUNT_PERIOD_S);
+    }
+    return nullptr;
+}
+
+static void* count_announcer(void*) {
+    while (true) {
+        announce_count();
+        sleep(COUNT_PERIOD_S);
+    }
+    return nullptr;
+}
+
+// Parses "ip:port,ip:port" and starts one dialer per entry.
+static void start_dialers(const std::string& list) {
+    istringstream in(list);
+    std::string item;
+    while (getline(in, item, ',')) {
+        item.erase(remove(item.begin(), item.end(), ' '), item.end());
+        size_t colon = item.rfind(':');
+        if (item.empty() || colon == std::string::npos) continue;
+        sockaddr_in* addr = new sockaddr_in{};
+        addr->sin_family = AF_INET;
+        addr->sin_port   = htons(atoi(item.substr(colon + 1).c_str()));
+        if (inet_pton(AF_INET, item.substr(0, colon).c_str(), &addr->sin_addr) <= 0) {
+            cout << "Invalid peer address: " << item << endl;
+            delete addr;
+            continue;
+        }
+        pthread_t tid;
+        pthread_create(&tid, nullptr, peer_dialer, addr);
+        pthread_detach(tid);
     }
-    pthread_mutex_unlock(&clients_mtx);
 }
 
 int main() {
@@ -34,6 +443,8 @@ int main() {
     struct sockaddr_in ServerAddr;
     socklen_t addrlen = sizeof(ServerAddr);
 
+    trace_init();
+
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
         cout << "Socket creation error!" << endl;
         exit(EXIT_FAILURE);
@@ -48,6 +459,7 @@ int main() {
     cout << "Please enter the listening port: ";
     cin.getline(buffer, 9, '\n');
     ServerAddr.sin_port = htons(atoi(buffer));
+    node_id = "n" + std::string(buffer) + "-" + std::to_string(getpid());
 
     if (bind(server_fd, (struct sockaddr*)&ServerAddr, sizeof(ServerAddr)) < 0) {
         cout << "Bind failed!!" << endl;
@@ -59,6 +471,38 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    // Federation setup (blank answers keep the server standalone)
+    cout << "Please enter the peer listening port (blank for none): ";
+    cin.getline(buffer, 9, '\n');
+    if (strlen(buffer)) {
+        int peer_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in PeerAddr{};
+        PeerAddr.sin_family      = AF_INET;
+        PeerAddr.sin_addr.s_addr = INADDR_ANY;
+        PeerAddr.sin_port        = htons(atoi(buffer));
+        setsockopt(peer_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (peer_fd < 0 ||
+            bind(peer_fd, (struct sockaddr*)&PeerAddr, sizeof(PeerAddr)) < 0 ||
+            listen(peer_fd, 16) < 0) {
+            cout << "Peer listen failure!" << endl;
+            exit(EXIT_FAILURE);
+        }
+        pthread_t tid;
+        pthread_create(&tid, nullptr, peer_listener, new int(peer_fd));
+        pthread_detach(tid);
+    }
+    cout << "Please enter peers as ip:port[,ip:port...] (blank for none): ";
+    cin.getline(buffer, sizeof(buffer), '\n');
+    start_dialers(buffer);
+
+    pthread_t announcer;
+    pthread_create(&announcer, nullptr, count_announcer, nullptr);
+    pthread_detach(announcer);
+    pthread_t fanout;
+    pthread_create(&fanout, nullptr, fanout_worker, nullptr);
+    pthread_detach(fanout);
+    cout << "Node id: " << node_id << endl;
+
     while (true) {
         new_socket = accept(server_fd, (struct sockaddr*)&ServerAddr, &addrlen);
         if (new_socket < 0) {
@@ -67,13 +511,15 @@ int main() {
         }
 
         // Track client socket
-        pthread_mutex_lock(&clients_mtx);
-        clients.push_back(new_socket);
-        pthread_mutex_unlock(&clients_mtx);
+        auto client = make_shared<Client>(new_socket);
+        pthread_mutex_lock(&clients.mtx);
+        clients.list.push_back(client);
+        pthread_mutex_unlock(&clients.mtx);
+        client_count.fetch_add(1);
 
         // Spawn handler thread
         pthread_t tid;
-        pthread_create(&tid, nullptr, respond, new int(new_socket));
+        pthread_create(&tid, nullptr, respond, new shared_ptr<Client>(client));
         pthread_detach(tid);
 
         // Update count
@@ -86,45 +532,74 @@ int main() {
 }
 
 void* respond(void* arg) {
-    int new_socket = *reinterpret_cast<int*>(arg);
-    delete reinterpret_cast<int*>(arg);
+    shared_ptr<Client> self = *reinterpret_cast<shared_ptr<Client>*>(arg);
+    delete reinterpret_cast<shared_ptr<Client>*>(arg);
+    int new_socket = self->fd;
 
     char buffer[1024] = {0};
     int nBytes = 0;
 
     while ( (nBytes = read(new_socket, buffer, sizeof(buffer) - 1)) > 0 ) {
+        unsigned long long trace_id = trace_begin();
+        long long t_recv = trace_start(trace_id);
+        trace_mark(trace_id, "recv", t_recv, nBytes);
+
         buffer[nBytes] = '\0';
         std::string line(buffer);
 
         // Commands:
         if (line.rfind("/say ", 0) == 0) {
             std::string text = line.substr(5);
-            broadcast_except(new_socket, text);
+            trace_span(trace_id, "parse", t_recv);
+
+            long long t_bcast = trace_start(trace_id);
+            broadcast_except(clients, new_socket, text, trace_id);
+            trace_span(trace_id, "broadcast", t_bcast);
+
+            // One RELAY per peer link; newlines would break peer framing
+            replace(text.begin(), text.end(), '\n', ' ');
+            unsigned long long id;
+            pthread_mutex_lock(&seen_mtx);
+            id = next_msg_id++;
+            pthread_mutex_unlock(&seen_mtx);
+            mark_seen(node_id, id);
+            long long t_relay = trace_start(trace_id);
+            relay_to_peers(-1, "RELAY " + node_id + " " + std::to_string(id) +
+                               " " + text + "\n");
+            trace_span(trace_id, "relay", t_relay);
         } else if (line == "/stats") {
+            trace_span(trace_id, "parse", t_recv);
             auto now  = std::chrono::steady_clock::now();
             auto secs = std::chrono::duration_cast<std::chrono::seconds>(now - server_start).count();
 
-            int count_now;
-            pthread_mutex_lock(&clients_mtx);
-            count_now = (int)clients.size();
-            pthread_mutex_unlock(&clients_mtx);
+            int count_now = client_count.load();
+
+            int cluster_clients, cluster_nodes;
+            cluster_totals(cluster_clients, cluster_nodes);
 
             std::string reply = "clients=" + std::to_string(count_now) +
-                                " uptime_s=" + std::to_string(secs);
-            send(new_socket, reply.c_str(), reply.size(), 0);
+                                " uptime_s=" + std::to_string(secs) +
+                                " cluster_clients=" + std::to_string(cluster_clients) +
+                                " cluster_nodes=" + std::to_string(cluster_nodes);
+            long long t_send = trace_start(trace_id);
+            send_control(*self, reply);
+            trace_span(trace_id, "send", t_send, new_socket);
         } else {
             // Optional: echo fallback or ignore
             // send(new_socket, buffer, strlen(buffer), 0);
         }
+        trace_span(trace_id, "message", t_recv);
         memset(buffer, 0, sizeof(buffer));
     }
 
     // Cleanup on disconnect
-    pthread_mutex_lock(&clients_mtx);
-    clients.erase(remove(clients.begin(), clients.end(), new_socket), clients.end());
-    pthread_mutex_unlock(&clients_mtx);
+    pthread_mutex_lock(&clients.mtx);
+    clients.list.erase(remove(clients.list.begin(), clients.list.end(), self), clients.list.end());
+    pthread_mutex_unlock(&clients.mtx);
+    client_count.fetch_sub(1);
 
-    close(new_socket);
+    // Socket closes once no broadcast snapshot still holds it
+    self.reset();
 
     pthread_mutex_lock(&count_mtx);
     thread_count--;
@@ -0,0 +1,185 @@
+// Sampled per-message tracing for the chat servers, dumped as Chrome
+// trace_event JSON (open the file in Perfetto or chrome://tracing).
+//
+//   CHAT_TRACE_SAMPLE=N   trace one message in N (unset or 0 = off)
+//   CHAT_TRACE_FILE=path  output file (default chat_trace.json)
+//
+// Events go to per-thread buffers and are written when the server receives
+// SIGINT or SIGTERM. With sampling off every hook is a single branch.
+// Memory is bounded: at most TRACE_MAX_EVENTS are kept across all threads,
+// and a finished thread's buffer (events included) is handed to the next new
+// thread, so buffers track peak concurrency, not total connections.
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+struct TraceEvent {
+    const char* name;
+    unsigned long long id;   // sampled message id
+    long long ts_ns;
+    long long dur_ns;        // < 0 marks an instant event
+    int arg;                 // fd, byte count, ... (-1 = none)
+};
+
+struct TraceBuffer {
+    pthread_mutex_t mtx;
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+static const size_t TRACE_MAX_EVENTS = 1 << 20;  // across all threads
+static std::atomic<size_t> trace_event_count{0};
+static unsigned trace_sample_every = 0;
+static std::atomic<unsigned long long> trace_seq{0};
+static std::string trace_path = "chat_trace.json";
+static pthread_mutex_t trace_registry_mtx = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceBuffer*> trace_registry;
+static std::vector<TraceBuffer*> trace_free;   // buffers of exited threads
+
+static inline long long trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns a non-zero id when this message is sampled, 0 otherwise.
+static inline unsigned long long trace_begin() {
+    if (!trace_sample_every) return 0;
+    unsigned long long n = trace_seq.fetch_add(1, std::memory_order_relaxed);
+    return (n % trace_sample_every == 0) ? n + 1 : 0;
+}
+
+// Start timestamp for a span, only taken for sampled messages.
+static inline long long trace_start(unsigned long long id) { return id ? trace_now() : 0; }
+
+// Returns the thread's buffer to trace_free when the thread exits.
+struct TraceBufferLease {
+    TraceBuffer* buf = nullptr;
+    ~TraceBufferLease() {
+        if (!buf) return;
+        pthread_mutex_lock(&trace_registry_mtx);
+        trace_free.push_back(buf);
+        pthread_mutex_unlock(&trace_registry_mtx);
+    }
+};
+
+static inline TraceBuffer* trace_buffer() {
+    thread_local TraceBufferLease lease;
+    if (!lease.buf) {
+        pthread_mutex_lock(&trace_registry_mtx);
+        if (!trace_free.empty()) {
+            lease.buf = trace_free.back();
+            trace_free.pop_back();
+        } else {
+            lease.buf = new TraceBuffer();
+            pthread_mutex_init(&lease.buf->mtx, nullptr);
+            lease.buf->tid = (int)trace_registry.size() + 1;
+            trace_registry.push_back(lease.buf);
+        }
+        pthread_mutex_unlock(&trace_registry_mtx);
+    }
+    return lease.buf;
+}
+
+static inline void trace_record(unsigned long long id, const char* name,
+                                long long ts_ns, long long dur_ns, int arg) {
+    if (trace_event_count.fetch_add(1, std::memory_order_relaxed) >= TRACE_MAX_EVENTS) return;
+    TraceBuffer* buf = trace_buffer();
+    pthread_mutex_lock(&buf->mtx);
+    buf->events.push_back(TraceEvent{name, id, ts_ns, dur_ns, arg});
+    pthread_mutex_unlock(&buf->mtx);
+}
+
+// Records a span from `start_ns` until now.
+static inline void trace_span(unsigned long long id, const char* name,
+                              long long start_ns, int arg = -1) {
+    if (!id) return;
+    trace_record(id, name, start_ns, trace_now() - start_ns, arg);
+}
+
+// Records a point-in-time event.
+static inline void trace_mark(unsigned long long id, const char* name,
+                              long long ts_ns, int arg = -1) {
+    if (!id) return;
+    trace_record(id, name, ts_ns, -1, arg);
+}
+
+static inline void trace_dump() {
+    std::ofstream out(trace_path);
+    if (!out) {
+        std::cerr << "Cannot write trace to " << trace_path << std::endl;
+        return;
+    }
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    size_t total = 0;
+    pthread_mutex_lock(&trace_registry_mtx);
+    for (TraceBuffer* buf : trace_registry) {
+        pthread_mutex_lock(&buf->mtx);
+        for (const TraceEvent& e : buf->events) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "{\"name\":\"" << e.name << "\",\"cat\":\"msg\""
+                << ",\"pid\":" << getpid() << ",\"tid\":" << buf->tid
+                << ",\"ts\":" << e.ts_ns / 1000.0;
+            if (e.dur_ns < 0)
+                out << ",\"ph\":\"i\",\"s\":\"t\"";
+            else
+                out << ",\"ph\":\"X\",\"dur\":" << e.dur_ns / 1000.0;
+            out << ",\"args\":{\"msg\":" << e.id;
+            if (e.arg >= 0) out << ",\"arg\":" << e.arg;
+            out << "}}";
+        }
+        total += buf->events.size();
+        pthread_mutex_unlock(&buf->mtx);
+    }
+    pthread_mutex_unlock(&trace_registry_mtx);
+    out << "\n]}\n";
+    std::cerr << "Wrote " << total << " trace events to " << trace_path;
+    size_t attempted = trace_event_count.load();
+    if (attempted > total) std::cerr << " (" << attempted - total << " dropped over budget)";
+    std::cerr << std::endl;
+}
+
+static inline void* trace_signal_thread(void* arg) {
+    sigset_t* set = reinterpret_cast<sigset_t*>(arg);
+    int sig;
+    sigwait(set, &sig);
+    trace_dump();
+    _exit(0);
+}
+
+// Reads the environment and, when sampling is on, arranges for the trace to
+// be dumped on SIGINT/SIGTERM. Call from main() before creating any thread so
+// that every thread inherits the blocked signal mask.
+static inline void trace_init() {
+    const char* every = getenv("CHAT_TRACE_SAMPLE");
+    if (every) trace_sample_every = (unsigned)atoi(every);
+    if (!trace_sample_every) return;
+    if (const char* path = getenv("CHAT_TRACE_FILE")) trace_path = path;
+
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    pthread_t tid;
+    pthread_create(&tid, nullptr, trace_signal_thread, &set);
+    pthread_detach(tid);
+    std::cerr << "Tracing 1 in " << trace_sample_every << " messages -> "
+              << trace_path << " (written on Ctrl-C)" << std::endl;
+}
+
+#endif
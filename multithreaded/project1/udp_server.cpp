@@ -4,43 +4,111 @@
 #include <cstring>
 #include <cstdint>
 #include <chrono>
+#include <deque>
+#include <memory>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 
-using namespace std;
-
-#pragma pack(push,1)
-struct MsgHeader {
-    uint16_t type;   // 1=HELLO, 2=CHAT, 3=ACK
-    uint32_t seq;    // for CHAT and ACK
-    uint16_t len;    // payload length (bytes)
-};
-#pragma pack(pop)
+#include "chat_core.h"
+#include "trace.h"
 
-static const uint16_t MSG_HELLO = 1;
-static const uint16_t MSG_CHAT  = 2;
-static const uint16_t MSG_ACK   = 3;
+using namespace std;
 
-struct Endpoint {
-    sockaddr_in addr;
-};
 static vector<Endpoint> clients;
 
-static bool same_ep(const sockaddr_in& a, const sockaddr_in& b) {
-    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+static Endpoint* find_client(const sockaddr_in& ep) {
+    return find_endpoint(clients, ep);
 }
 
-static void add_client(const sockaddr_in& ep) {
-    for (auto &c : clients) if (same_ep(c.addr, ep)) return;
-    Endpoint e; e.addr = ep; clients.push_back(e);
+static Endpoint* add_client(const sockaddr_in& ep) {
+    // A HELLO starts a new session (seq restarts at 1), so reset its window
+    if (Endpoint* c = find_client(ep)) { c->max_seq = 0; c->window = 0; return c; }
+    Endpoint e; e.addr = ep; e.max_seq = 0; e.window = 0; clients.push_back(e);
     cerr << "Registered client " << inet_ntoa(ep.sin_addr)
          << ":" << ntohs(ep.sin_port) << "\n";
+    return &clients.back();
+}
+
+// Outbound datagram. ACKs and other control replies go to ctrl_lane and chat
+// fan-out to bulk_lane. The control lane is always flushed first and bulk is
+// sent in small batches between socket reads, so an ACK never waits behind a
+// whole broadcast (udp_client retransmits after 600 ms without one).
+// Above BULK_HIGH_WATER queued packets the server stops reading, so it never
+// ACKs more than that much undelivered fan-out; excess datagrams drop in the
+// kernel and clients fall back to retransmitting, as before the lanes.
+struct OutPacket {
+    shared_ptr<vector<char>> data;
+    sockaddr_in dst;
+    unsigned long long trace_id;
+    long long t_recv;
+    bool last;   // final packet for this message (ends its trace span)
+};
+static deque<OutPacket> ctrl_lane, bulk_lane;
+static const size_t RECV_BATCH = 64;
+static const size_t BULK_BATCH = 16;
+static const size_t BULK_HIGH_WATER = 4096;
+
+static void queue_ack(const sockaddr_in& dst, uint32_t seq,
+                      unsigned long long trace_id, long long t_recv) {
+    auto data = encode_packet(MSG_ACK, seq, nullptr, 0);
+    ctrl_lane.push_back(OutPacket{data, dst, trace_id, t_recv, false});
+}
+
+static void handle_datagram(const char* buf, size_t n, const sockaddr_in& src) {
+    MsgHeader hdr;
+    if (!decode_header(buf, n, hdr)) return;
+
+    unsigned long long trace_id = trace_begin();
+    long long t_recv = trace_start(trace_id);
+    trace_mark(trace_id, "recv", t_recv, (int)n);
+    trace_span(trace_id, "parse", t_recv);
+
+    if (hdr.type == MSG_HELLO) {
+        add_client(src);
+        // optional: send ACK(seq=0) as a welcome
+        queue_ack(src, 0u, trace_id, t_recv);
+    } else if (hdr.type == MSG_CHAT) {
+        // ACK back to sender (Stop-and-Wait)
+        queue_ack(src, hdr.seq, trace_id, t_recv);
+
+        // udp_client sends HELLO only once, so a sender whose HELLO was lost
+        // is registered by its first CHAT; its retransmissions are then
+        // recognised like everyone else's.
+        Endpoint* sender = find_client(src);
+        if (!sender) sender = add_client(src);
+
+        // Retransmission after a lost ACK: re-ACK only, do not fan out again
+        if (behind_window(*sender, hdr.seq))
+            cerr << "Session reset by " << inet_ntoa(src.sin_addr) << ":" << ntohs(src.sin_port)
+                 << " (seq " << hdr.seq << " after " << sender->max_seq << ")\n";
+        if (seen_before(*sender, hdr.seq)) {
+            trace_span(trace_id, "duplicate", t_recv);
+            return;
+        }
+
+        // Broadcast payload to all known clients except sender
+        size_t plen = payload_len(hdr, n);
+        auto out = encode_packet(MSG_CHAT, hdr.seq, buf + sizeof(MsgHeader), plen);
+
+        size_t first = bulk_lane.size();
+        for (auto &c : clients) {
+            if (same_ep(c.addr, src)) continue;
+            bulk_lane.push_back(OutPacket{out, c.addr, trace_id, t_recv, false});
+        }
+        if (bulk_lane.size() > first) {
+            bulk_lane.back().last = true;
+            return;
+        }
+    }
+    trace_span(trace_id, "message", t_recv);
 }
 
 int main() {
+    trace_init();
+
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) { perror("socket"); return 1; }
 
@@ -61,42 +129,33 @@ int main() {
 
     char buf[2048];
     for (;;) {
-        sockaddr_in src{}; socklen_t slen = sizeof(src);
-        ssize_t n = recvfrom(sockfd, buf, sizeof(buf), 0, (sockaddr*)&src, &slen);
-        if (n <= 0) continue;
-        if ((size_t)n < sizeof(MsgHeader)) continue;
-
-        MsgHeader hdr;
-        memcpy(&hdr, buf, sizeof(hdr));
-        hdr.type = ntohs(hdr.type);
-        hdr.seq  = ntohl(hdr.seq);
-        hdr.len  = ntohs(hdr.len);
-
-        if (hdr.type == MSG_HELLO) {
-            add_client(src);
-            // optional: send ACK(seq=0) as a welcome
-            MsgHeader ack{htons(MSG_ACK), htonl(0u), htons(0)};
-            sendto(sockfd, &ack, sizeof(ack), 0, (sockaddr*)&src, slen);
-        } else if (hdr.type == MSG_CHAT) {
-            // ACK back to sender (Stop-and-Wait)
-            MsgHeader ack{htons(MSG_ACK), htonl(hdr.seq), htons(0)};
-            sendto(sockfd, &ack, sizeof(ack), 0, (sockaddr*)&src, slen);
-
-            // Broadcast payload to all known clients except sender
-            size_t plen = 0;
-            if ((size_t)n > sizeof(MsgHeader))
-                plen = min<size_t>(hdr.len, (size_t)n - sizeof(MsgHeader));
-
-            vector<char> out(sizeof(MsgHeader) + plen);
-            MsgHeader oh{htons(MSG_CHAT), htonl(hdr.seq), htons((uint16_t)plen)};
-            memcpy(out.data(), &oh, sizeof(oh));
-            if (plen) memcpy(out.data() + sizeof(MsgHeader), buf + sizeof(MsgHeader), plen);
-
-            for (auto &c : clients) {
-                if (same_ep(c.addr, src)) continue;
-                sendto(sockfd, out.data(), out.size(), 0,
-                       (sockaddr*)&c.addr, sizeof(c.addr));
-            }
+        // Drain what has arrived; block only when both lanes are empty.
+        for (size_t i = 0; i < RECV_BATCH && bulk_lane.size() < BULK_HIGH_WATER; ++i) {
+            int flags = (i == 0 && ctrl_lane.empty() && bulk_lane.empty()) ? 0 : MSG_DONTWAIT;
+            sockaddr_in src{}; socklen_t slen = sizeof(src);
+            ssize_t n = recvfrom(sockfd, buf, sizeof(buf), flags, (sockaddr*)&src, &slen);
+            if (n < 0) break;
+            handle_datagram(buf, (size_t)n, src);
+        }
+
+        // High-priority lane: every pending ACK goes out first
+        while (!ctrl_lane.empty()) {
+            OutPacket& p = ctrl_lane.front();
+            sendto(sockfd, p.data->data(), p.data->size(), 0,
+                   (sockaddr*)&p.dst, sizeof(p.dst));
+            trace_span(p.trace_id, "ack", p.t_recv);
+            ctrl_lane.pop_front();
+        }
+
+        // Bulk lane: a bounded batch, then back to the socket
+        for (size_t i = 0; i < BULK_BATCH && !bulk_lane.empty(); ++i) {
+            OutPacket& p = bulk_lane.front();
+            long long t_send = trace_start(p.trace_id);
+            sendto(sockfd, p.data->data(), p.data->size(), 0,
+                   (sockaddr*)&p.dst, sizeof(p.dst));
+            trace_span(p.trace_id, "send", t_send, ntohs(p.dst.sin_port));
+            if (p.last) trace_span(p.trace_id, "message", p.t_recv);
+            bulk_lane.pop_front();
         }
     }
 